@@ -30,6 +30,8 @@
 #include <kdebug.h>
 #include <kgenericfactory.h>
 
+#include <QMutexLocker>
+
 #include <KoUpdater.h>
 
 #include <kis_multi_double_filter_widget.h>
@@ -67,7 +69,13 @@ KritaDither::~KritaDither()
 }
 
 KisDitherFilter::KisDitherFilter() 
-    : KisFilter(id(), categoryColors(), i18n("&Dither"))
+    : KisFilter(id(), categoryColors(), i18n("&Dither")), m_sequencesUse(0)
+{
+}
+
+KisDitherFilter::PaletteSequence::PaletteSequence()
+    : reduction(-1), paletteSize(-1), paletteWindow(-1), framesSinceOptimization(0),
+      optimizing(false), optimizingFrame(-1), resets(0), users(0), lastUse(0)
 {
 }
 
@@ -76,6 +84,10 @@ KisFilterConfiguration* KisDitherFilter::configuration()
     KisFilterConfiguration* config = new KisFilterConfiguration(id().id(),1);
     config->setProperty("paletteSize", 16);
     config->setProperty("paletteType", 0);
+    config->setProperty("paletteSequence", QString());
+    config->setProperty("paletteFrame", -1);
+    config->setProperty("paletteWindow", 1);
+    config->setProperty("paletteWarmStart", false);
     return config;
 };
 
@@ -156,7 +168,16 @@ void mutate(Genom& g)
     g.palette[index] = c;
 }
 
-std::vector<QColor> KisDitherFilter::optimizeColors( const std::map<QColor, int>& colors2int, int paletteSize, int& pixelsProcessed, KoUpdater* progressUpdater ) const
+// Size of the population and number of iterations without improvement when the optimization
+// starts from a previous palette, which is expected to already be close to the best one
+static const uint warmStartPopulation = 16;
+static const int warmStartIterations = 3;
+static const int coldStartIterations = 10;
+// Number of idle palette sequences kept, and of frame palettes remembered by a sequence
+static const uint maxPaletteSequences = 4;
+static const uint maxRememberedFrames = 64;
+
+std::vector<QColor> KisDitherFilter::optimizeColors( const std::map<QColor, int>& colors2int, int paletteSize, const std::vector<QColor>& initialPalette, bool processEvents, int& pixelsProcessed, KoUpdater* progressUpdater ) const
 {
     std::vector<ColorInt> colorsInt;
     for(std::map<QColor, int>::const_iterator it = colors2int.begin();
@@ -178,9 +199,10 @@ std::vector<QColor> KisDitherFilter::optimizeColors( const std::map<QColor, int>
     }
     // Init the genom
     kdDebug() << "Initialize the genom" << endl;
+    bool warmStart = ( initialPalette.size() == (uint)paletteSize );
     std::multimap<double, Genom> genoms;
     for( std::multimap<int, QColor>::iterator it = int2colors.begin();
-         it != int2colors.end() ; )
+         it != int2colors.end() and not ( warmStart and genoms.size() >= warmStartPopulation / 2 ); )
     {
         Genom g;
         while( g.palette.size() < (uint)paletteSize )
@@ -192,13 +214,35 @@ std::vector<QColor> KisDitherFilter::optimizeColors( const std::map<QColor, int>
         genoms.insert( std::multimap<double, Genom>::value_type( g.error, g) );
         kdDebug() << g.error << " " << genoms.size() << " out of " << (colors2int.size() / paletteSize) << endl;
     }
+    if( warmStart )
+    {
+        // Only a few genoms built from the most used colors are kept, in case the colors
+        // changed a lot, the others are the previous palette and mutations of it
+        kdDebug() << "Initialize the genom from the previous palette" << endl;
+        Genom g;
+        g.palette = initialPalette;
+        g.computeError(colorsInt);
+        genoms.insert( std::multimap<double, Genom>::value_type( g.error, g) );
+        while( genoms.size() < warmStartPopulation )
+        {
+            Genom g;
+            g.palette = initialPalette;
+            for(int j = 0; j < paletteSize; ++j)
+            {
+                mutate(g);
+            }
+            g.computeError(colorsInt);
+            genoms.insert( std::multimap<double, Genom>::value_type( g.error, g) );
+        }
+    }
     if( genoms.size() & 1 )
     { // Ensure the parity, as we kill half of the genoms
         genoms.insert(  *genoms.begin() );
     }
     double currentBest = genoms.begin()->first;
     int iter = 0;
-    for(int iter2 = 0; iter2 < 10; iter++, iter2++)
+    int maxIterations = warmStart ? warmStartIterations : coldStartIterations;
+    for(int iter2 = 0; iter2 < maxIterations; iter++, iter2++)
     {
         kdDebug() << "Iteration : " << iter << endl;
         // Reproduction
@@ -232,7 +276,10 @@ std::vector<QColor> KisDitherFilter::optimizeColors( const std::map<QColor, int>
             c2.computeError(colorsInt);
             genoms.insert( std::multimap<double, Genom>::value_type( c1.error, c1) );
             genoms.insert( std::multimap<double, Genom>::value_type( c2.error, c2) );
-            kapp->processEvents();
+            if( processEvents )
+            {
+                kapp->processEvents();
+            }
         }
         // Kill the bad genoms
         std::multimap<double, Genom> newGenoms;
@@ -253,12 +300,164 @@ std::vector<QColor> KisDitherFilter::optimizeColors( const std::map<QColor, int>
         }
     }
     
-    kdDebug() << "Optimization is finished" << endl;
+    kdDebug() << "Optimization is finished after " << iter << " iterations" << endl;
     kdDebug() << genoms.begin()->first << endl;
     return genoms.begin()->second.palette;
 }
 
-void KisDitherFilter::generateOptimizedPalette(quint8** colorPalette, int reduction, KisPaintDeviceSP src, const QRect& rect, int paletteSize, int& pixelsProcessed, KoUpdater* progressUpdater ) const
+void KisDitherFilter::resetPaletteSequence(const QString& paletteSequence) const
+{
+    QMutexLocker locker(&m_sequencesMutex);
+    std::map<QString, PaletteSequence>::iterator it = m_sequences.find(paletteSequence);
+    if( it == m_sequences.end() ) return;
+    PaletteSequence& sequence = it->second;
+    if( sequence.users == 0 and not sequence.optimizing )
+    {
+        m_sequences.erase( it );
+        return;
+    }
+    // Calls in progress still refer to the sequence, the palette they compute is dropped
+    sequence.frames.clear();
+    sequence.framePalettes.clear();
+    sequence.mergedHistogram.clear();
+    sequence.palette.clear();
+    sequence.framesSinceOptimization = 0;
+    ++sequence.resets;
+}
+
+std::vector<QColor> KisDitherFilter::optimizeSequenceColors( const QString& paletteSequence, int paletteFrame, const std::map<QColor, int>& colors2int, int reduction, int paletteSize, int paletteWindow, bool paletteWarmStart, int& pixelsProcessed, KoUpdater* progressUpdater ) const
+{
+    QMutexLocker locker(&m_sequencesMutex);
+    PaletteSequence& sequence = m_sequences[paletteSequence];
+    sequence.lastUse = ++m_sequencesUse;
+    ++sequence.users;
+    if( sequence.reduction != reduction or sequence.paletteSize != paletteSize or sequence.paletteWindow != paletteWindow )
+    {
+        kdDebug() << "Start palette sequence " << paletteSequence << " over" << endl;
+        sequence.frames.clear();
+        sequence.framePalettes.clear();
+        sequence.mergedHistogram.clear();
+        sequence.palette.clear();
+        sequence.framesSinceOptimization = 0;
+        sequence.reduction = reduction;
+        sequence.paletteSize = paletteSize;
+        sequence.paletteWindow = paletteWindow;
+        ++sequence.resets;
+    }
+    int resets = sequence.resets;
+    
+    // Other calls for a frame (for instance its other rects) do not add it again
+    bool known = ( paletteFrame >= 0 and sequence.framePalettes.find( paletteFrame ) != sequence.framePalettes.end() );
+    for(uint i = 0; paletteFrame >= 0 and i < sequence.frames.size(); ++i)
+    {
+        if( sequence.frames[i].frame == paletteFrame ) known = true;
+    }
+    if( not known )
+    {
+        // Add the frame to the merged histogram, and remove the frames that left the window
+        PaletteFrame newFrame;
+        newFrame.frame = paletteFrame;
+        newFrame.histogram.assign( colors2int.begin(), colors2int.end() );
+        sequence.frames.push_back( newFrame );
+        for( std::map<QColor, int>::const_iterator it = colors2int.begin(); it != colors2int.end(); ++it)
+        {
+            sequence.mergedHistogram[ it->first ] += it->second;
+        }
+        while( sequence.frames.size() > (uint)paletteWindow )
+        {
+            const std::vector< std::pair<QColor, int> >& evicted = sequence.frames.front().histogram;
+            for( std::vector< std::pair<QColor, int> >::const_iterator it = evicted.begin(); it != evicted.end(); ++it)
+            {
+                std::map<QColor, int>::iterator it2 = sequence.mergedHistogram.find( it->first );
+                Q_ASSERT( it2 != sequence.mergedHistogram.end() and it2->second >= it->second );
+                it2->second -= it->second;
+                if( it2->second == 0 )
+                {
+                    sequence.mergedHistogram.erase( it2 );
+                }
+            }
+            sequence.frames.pop_front();
+        }
+    }
+    
+    std::vector<QColor> palette;
+    while( palette.empty() )
+    {
+        std::map<int, std::vector<QColor> >::iterator it = sequence.framePalettes.find( paletteFrame );
+        if( paletteFrame >= 0 and it != sequence.framePalettes.end() )
+        {
+            palette = it->second;
+            break;
+        }
+        if( not sequence.palette.empty() and ( sequence.framesSinceOptimization < paletteWindow
+            or ( sequence.optimizing and ( paletteFrame < 0 or paletteFrame != sequence.optimizingFrame ) ) ) )
+        {
+            // Inside a batch, or while the palette of the next batch is being optimized for another frame
+            kdDebug() << "Reuse the palette of sequence " << paletteSequence << endl;
+            ++sequence.framesSinceOptimization;
+            palette = sequence.palette;
+            break;
+        }
+        if( sequence.optimizing )
+        {
+            // Either this frame or the first batch of the sequence is being optimized
+            m_sequencesCondition.wait(&m_sequencesMutex);
+            continue;
+        }
+        std::map<QColor, int> mergedHistogram = sequence.mergedHistogram;
+        std::vector<QColor> initialPalette;
+        if( paletteWarmStart )
+        {
+            initialPalette = sequence.palette;
+        }
+        sequence.optimizing = true;
+        sequence.optimizingFrame = paletteFrame;
+        
+        // The lock is not held during the optimization, events are not processed as they could
+        // call process again on this thread
+        locker.unlock();
+        palette = optimizeColors( mergedHistogram, paletteSize, initialPalette, false, pixelsProcessed, progressUpdater );
+        locker.relock();
+        
+        sequence.optimizing = false;
+        if( sequence.resets == resets )
+        {
+            sequence.palette = palette;
+            sequence.framesSinceOptimization = 1;
+        }
+        m_sequencesCondition.wakeAll();
+    }
+    
+    // Remember the palette of numbered frames a bit longer than the window, for late rects
+    if( paletteFrame >= 0 and sequence.resets == resets )
+    {
+        sequence.framePalettes.insert( std::map<int, std::vector<QColor> >::value_type( paletteFrame, palette ) );
+        while( sequence.framePalettes.size() > maxRememberedFrames )
+        {
+            sequence.framePalettes.erase( sequence.framePalettes.begin() );
+        }
+    }
+    
+    // Forget the least recently used sequences
+    --sequence.users;
+    while( m_sequences.size() > maxPaletteSequences )
+    {
+        std::map<QString, PaletteSequence>::iterator oldest = m_sequences.end();
+        for( std::map<QString, PaletteSequence>::iterator it = m_sequences.begin(); it != m_sequences.end(); ++it)
+        {
+            if( it->second.users == 0 and not it->second.optimizing
+                and ( oldest == m_sequences.end() or it->second.lastUse < oldest->second.lastUse ) )
+            {
+                oldest = it;
+            }
+        }
+        if( oldest == m_sequences.end() ) break;
+        m_sequences.erase( oldest );
+    }
+    return palette;
+}
+
+void KisDitherFilter::generateOptimizedPalette(quint8** colorPalette, int reduction, KisPaintDeviceSP src, const QRect& rect, int paletteSize, const QString& paletteSequence, int paletteFrame, int paletteWindow, bool paletteWarmStart, int& pixelsProcessed, KoUpdater* progressUpdater ) const
 {
     KoColorSpace * cs = src->colorSpace();
     qint32 pixelSize = cs->pixelSize();
@@ -282,7 +481,13 @@ void KisDitherFilter::generateOptimizedPalette(quint8** colorPalette, int reduct
         c.setRgb( c.red() << reduction, c.green() << reduction, c.blue() << reduction );
         colors2intBis[c] = it->second;
     }
-    std::vector<QColor> colors = optimizeColors( colors2intBis, paletteSize, pixelsProcessed, progressUpdater );
+    std::vector<QColor> colors;
+    if( paletteSequence.isEmpty() )
+    {
+        colors = optimizeColors( colors2intBis, paletteSize, std::vector<QColor>(), true, pixelsProcessed, progressUpdater );
+    } else {
+        colors = optimizeSequenceColors( paletteSequence, paletteFrame, colors2intBis, reduction, paletteSize, paletteWindow, paletteWarmStart, pixelsProcessed, progressUpdater );
+    }
     
     for(int i = 0; i < paletteSize; i++)
     {
@@ -321,6 +526,26 @@ void KisDitherFilter::process(KisConstProcessingInformation srcInfo,
     {
         paletteType = value.toInt(0);
     }
+    QString paletteSequence;
+    if (config->getProperty("paletteSequence", value))
+    {
+        paletteSequence = value.toString();
+    }
+    int paletteFrame = -1;
+    if (config->getProperty("paletteFrame", value))
+    {
+        paletteFrame = value.toInt(0);
+    }
+    int paletteWindow = 1;
+    if (config->getProperty("paletteWindow", value))
+    {
+        paletteWindow = qBound(1, value.toInt(0), 30);
+    }
+    bool paletteWarmStart = false;
+    if (config->getProperty("paletteWarmStart", value))
+    {
+        paletteWarmStart = value.toBool();
+    }
     quint8** colorPalette = new quint8*[paletteSize];
     switch(paletteType)
     {
@@ -330,7 +555,7 @@ void KisDitherFilter::process(KisConstProcessingInformation srcInfo,
             if (progressUpdater) {
                 progressUpdater->setRange(0, size.width() * size.height());
             }
-           generateOptimizedPalette(colorPalette, 4, src, QRect(srcInfo.topLeft(), size), paletteSize, pixelsProcessed, progressUpdater);
+           generateOptimizedPalette(colorPalette, 4, src, QRect(srcInfo.topLeft(), size), paletteSize, paletteSequence, paletteFrame, paletteWindow, paletteWarmStart, pixelsProcessed, progressUpdater);
            break;
         }
         case 1:
@@ -338,7 +563,7 @@ void KisDitherFilter::process(KisConstProcessingInformation srcInfo,
             if (progressUpdater) {
                 progressUpdater->setRange(0, size.width() * size.height());
             }
-           generateOptimizedPalette(colorPalette, 3, src, QRect(srcInfo.topLeft(), size), paletteSize, pixelsProcessed, progressUpdater);
+           generateOptimizedPalette(colorPalette, 3, src, QRect(srcInfo.topLeft(), size), paletteSize, paletteSequence, paletteFrame, paletteWindow, paletteWarmStart, pixelsProcessed, progressUpdater);
            break;
         }
         case 2:
@@ -24,6 +24,14 @@
 #define LCMS_HEADER <lcms.h>
 // TODO: remove it !
 
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+
 #include <kparts/plugin.h>
 #include <kis_filter.h>
 
@@ -56,9 +64,51 @@ public:
     virtual bool supportsAdjustmentLayers() { return true; }
     virtual KisConfigWidget * createConfigurationWidget(QWidget * parent, const KisPaintDeviceSP dev, const KisImageWSP image = 0) const;
     virtual KisFilterConfiguration* configuration();
+    /**
+     * Start the given palette sequence over, the next frame gets a new palette.
+     */
+    void resetPaletteSequence(const QString& paletteSequence) const;
 private:
-    std::vector<QColor> optimizeColors( const std::map<QColor, int>& colors2int, int paletteSize, int& pixelsProcessed, KoUpdater* progressUpdater ) const;
-    void generateOptimizedPalette(quint8** colorPalette, int reduction, KisPaintDeviceSP src, const QRect& rect, int paletteSize, int& pixelsProcessed, KoUpdater* progressUpdater ) const;
+    std::vector<QColor> optimizeColors( const std::map<QColor, int>& colors2int, int paletteSize, const std::vector<QColor>& initialPalette, bool processEvents, int& pixelsProcessed, KoUpdater* progressUpdater ) const;
+    std::vector<QColor> optimizeSequenceColors( const QString& paletteSequence, int paletteFrame, const std::map<QColor, int>& colors2int, int reduction, int paletteSize, int paletteWindow, bool paletteWarmStart, int& pixelsProcessed, KoUpdater* progressUpdater ) const;
+    void generateOptimizedPalette(quint8** colorPalette, int reduction, KisPaintDeviceSP src, const QRect& rect, int paletteSize, const QString& paletteSequence, int paletteFrame, int paletteWindow, bool paletteWarmStart, int& pixelsProcessed, KoUpdater* progressUpdater ) const;
+    /**
+     * A frame of a palette sequence, with the histogram it added to the merged histogram.
+     */
+    struct PaletteFrame {
+        int frame;
+        std::vector< std::pair<QColor, int> > histogram;
+    };
+    /**
+     * State of a named palette sequence. The frames are processed in batches of paletteWindow
+     * frames: the palette is optimized once for the first frame of a batch, using the merged
+     * histogram of that frame and of the paletteWindow - 1 frames before it, and the other frames
+     * of the batch reuse it. Frames that arrive while the next palette is being optimized keep
+     * the current one, instead of waiting for it.
+     *
+     * A frame is identified by the paletteFrame property, calls with the same frame number (for
+     * instance the rects of an adjustment layer) get the palette of that frame. When no frame
+     * number is given, each call is a new frame, which only makes sense for whole-frame calls.
+     * The sequence starts over when its settings change, or with resetPaletteSequence.
+     */
+    struct PaletteSequence {
+        PaletteSequence();
+        int reduction, paletteSize, paletteWindow;
+        std::deque<PaletteFrame> frames;
+        std::map<int, std::vector<QColor> > framePalettes;
+        std::map<QColor, int> mergedHistogram;
+        std::vector<QColor> palette;
+        int framesSinceOptimization;
+        bool optimizing;
+        int optimizingFrame;
+        int resets;
+        int users;
+        int lastUse;
+    };
+    mutable QMutex m_sequencesMutex;
+    mutable QWaitCondition m_sequencesCondition;
+    mutable std::map<QString, PaletteSequence> m_sequences;
+    mutable int m_sequencesUse;
 };
 
 #endif
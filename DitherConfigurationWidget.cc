@@ -21,9 +21,13 @@
 
 #include <qlayout.h>
 #include <qcombobox.h>
+#include <qcheckbox.h>
+#include <qlineedit.h>
+#include <qpushbutton.h>
 #include <knuminput.h>
 #include <klocale.h>
 #include <kis_filter_configuration.h>
+#include <kis_filter_registry.h>
 
 #include "ui_DitherConfigurationBaseWidget.h"
 #include "Dither.h"
@@ -34,6 +38,13 @@ DitherConfigurationWidget::DitherConfigurationWidget(QWidget * parent) : KisConf
     m_widget->setupUi(this);
     connect(m_widget->paletteType, SIGNAL(activated(int)), SIGNAL(sigPleaseUpdatePreview()));
     connect(m_widget->paletteSize, SIGNAL(valueChanged(int)), SIGNAL(sigPleaseUpdatePreview()));
+    connect(m_widget->paletteType, SIGNAL(activated(int)), SLOT(slotPaletteTypeChanged(int)));
+    connect(m_widget->paletteSequence, SIGNAL(editingFinished()), SIGNAL(sigPleaseUpdatePreview()));
+    connect(m_widget->paletteFrame, SIGNAL(valueChanged(int)), SIGNAL(sigPleaseUpdatePreview()));
+    connect(m_widget->paletteWindow, SIGNAL(valueChanged(int)), SIGNAL(sigPleaseUpdatePreview()));
+    connect(m_widget->paletteWarmStart, SIGNAL(toggled(bool)), SIGNAL(sigPleaseUpdatePreview()));
+    connect(m_widget->resetSequence, SIGNAL(clicked()), SLOT(slotResetSequence()));
+    slotPaletteTypeChanged(m_widget->paletteType->currentIndex());
 }
 
 
@@ -51,6 +62,23 @@ void DitherConfigurationWidget::setConfiguration(const KisPropertiesConfiguratio
     if (config->getProperty("paletteType", value))
     {
         m_widget->paletteType->setCurrentIndex(value.toInt(0));
+        slotPaletteTypeChanged(value.toInt(0));
+    }
+    if (config->getProperty("paletteSequence", value))
+    {
+        m_widget->paletteSequence->setText(value.toString());
+    }
+    if (config->getProperty("paletteFrame", value))
+    {
+        m_widget->paletteFrame->setValue(value.toInt(0));
+    }
+    if (config->getProperty("paletteWindow", value))
+    {
+        m_widget->paletteWindow->setValue(value.toInt(0));
+    }
+    if (config->getProperty("paletteWarmStart", value))
+    {
+        m_widget->paletteWarmStart->setChecked(value.toBool());
     }
 }
 
@@ -59,7 +87,32 @@ KisPropertiesConfiguration* DitherConfigurationWidget::configuration() const
     KisFilterConfiguration* config = new KisFilterConfiguration(KisDitherFilter::id().id(),1);
     config->setProperty("paletteSize", m_widget->paletteSize->value() );
     config->setProperty("paletteType", m_widget->paletteType->currentIndex() );
+    config->setProperty("paletteSequence", m_widget->paletteSequence->text() );
+    config->setProperty("paletteFrame", m_widget->paletteFrame->value() );
+    config->setProperty("paletteWindow", m_widget->paletteWindow->value() );
+    config->setProperty("paletteWarmStart", m_widget->paletteWarmStart->isChecked() );
     return config;
 }
 
+void DitherConfigurationWidget::slotPaletteTypeChanged(int paletteType)
+{
+    // Only the optimized palettes are shared by a sequence
+    bool optimized = ( paletteType == 0 or paletteType == 1 );
+    m_widget->paletteSequence->setEnabled(optimized);
+    m_widget->paletteFrame->setEnabled(optimized);
+    m_widget->paletteWindow->setEnabled(optimized);
+    m_widget->paletteWarmStart->setEnabled(optimized);
+    m_widget->resetSequence->setEnabled(optimized);
+}
+
+void DitherConfigurationWidget::slotResetSequence()
+{
+    KisFilterSP filter = KisFilterRegistry::instance()->value(KisDitherFilter::id().id());
+    const KisDitherFilter* ditherFilter = dynamic_cast<const KisDitherFilter*>(filter.data());
+    if (ditherFilter)
+    {
+        ditherFilter->resetPaletteSequence(m_widget->paletteSequence->text());
+    }
+}
+
 #include "DitherConfigurationWidget.moc"
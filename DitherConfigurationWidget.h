@@ -41,6 +41,9 @@ class DitherConfigurationWidget : public KisConfigWidget
         ~DitherConfigurationWidget();
         virtual void setConfiguration(const KisPropertiesConfiguration * config);
         virtual KisPropertiesConfiguration* configuration() const;
+    private slots:
+        void slotPaletteTypeChanged(int paletteType);
+        void slotResetSequence();
     private:
         Ui_DitherConfigurationBaseWidget* m_widget;
 };